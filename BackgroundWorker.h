@@ -0,0 +1,100 @@
+// kate: space-indent on; indent-width 2; mixedindent off; indent-mode cstyle;
+/*
+ *  The Closed Player - Kid-friendly MP3 player based on RFID tags
+ *  
+ *  See README.md for details and hardware setup.
+ *  
+ *  Copyright (c) 2019 Thomas Friedrichsmeier
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *  
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *  
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef BACKGROUNDWORKER_H
+#define BACKGROUNDWORKER_H
+
+#include <vector>
+
+/** A slow maintenance job (such as analyzing all tracks on the card), to be run by the BackgroundWorker. */
+class BackgroundJob {
+public:
+  BackgroundJob() {
+    run_requested = false;
+  }
+  /** Ask for the job to be run (again), as soon as the worker gets to it. */
+  void requestScan() {
+    run_requested = true;
+  }
+protected:
+  friend class BackgroundWorker;
+  /** Do the job. Implementations should check BackgroundWorker::shouldYield(), regularly, and return false, if it
+   *  is true. The job will then be run again, later, and should continue where it left off. */
+  virtual bool run() = 0;
+  virtual const char* name() const = 0;
+  volatile bool run_requested;
+};
+
+/** Runs all BackgroundJobs, one after the other, in a single task at lowest priority on core 0 (the main loop runs on
+ *  core 1). Jobs only run while nothing is playing, and not while the web interface is receiving data. */
+class BackgroundWorker {
+public:
+  BackgroundWorker() {
+    paused = false;
+    busy_until = 0;
+  }
+  void addJob(BackgroundJob *job) {
+    jobs.push_back(job);
+  }
+  /** Start the task. To be called after all jobs have been added. */
+  void begin() {
+    xTaskCreatePinnedToCore(task, "background", 10000, this, tskIDLE_PRIORITY, NULL, 0);
+  }
+  /** Pause all jobs, e.g. while playing. */
+  void setPaused(bool pause) {
+    paused = pause;
+  }
+  /** Hold off all jobs for a few seconds, e.g. on each chunk of data received by the web interface. */
+  void notifyActivity() {
+    busy_until = millis() + 3000;
+    if (!busy_until) busy_until = 1;
+  }
+  /** Whether jobs should stop as soon as possible. */
+  bool shouldYield() const {
+    if (paused) return true;
+    uint32_t until = busy_until;
+    return (until && (int32_t) (until - millis()) > 0);
+  }
+private:
+  static void task(void *p) {
+    BackgroundWorker *self = (BackgroundWorker *) p;
+    while (true) {
+      for (unsigned int i = 0; i < self->jobs.size(); ++i) {
+        BackgroundJob *job = self->jobs[i];
+        if (!job->run_requested || self->shouldYield()) continue;
+        job->run_requested = false;
+        Serial.print("Background job started: ");
+        Serial.println(job->name());
+        if (!job->run()) job->run_requested = true;  // interrupted: try again, later
+        else Serial.println("Background job complete");
+      }
+      vTaskDelay(500);
+    }
+  }
+
+  std::vector<BackgroundJob *> jobs;
+  volatile bool paused;
+  volatile uint32_t busy_until;
+};
+
+BackgroundWorker background;
+
+#endif
@@ -30,6 +30,7 @@ public:
     was_clicked = false;
     state = initial_on ? On : Off;
     last_state_change = millis();
+    pressed_since = last_state_change;
   }
 
   /** Return true, if button is currently pressed (NOT bouncing) */
@@ -42,6 +43,12 @@ public:
     return ((state == On) && (millis() - last_state_change >= HOLD_T));
   }
 
+  /** Return for how many milliseconds the button has been held (counting from the start of the press), or 0, if it is not held */
+  uint32_t heldFor() const {
+    if (!isHeld()) return 0;
+    return millis() - pressed_since;
+  }
+
   /** Return true, if button has been short-pressed since the last call to this function */
   bool wasClicked() {
     if (was_clicked) {
@@ -75,6 +82,7 @@ public:
         if (now - last_state_change > HOLD_T) last_state_change = now - HOLD_T; // avoid overflow
       } else if (state == Rising) {
         if (now - last_state_change >= DEBOUNCE_T) {
+          pressed_since = last_state_change;
           last_state_change = now;
           state = On;
         }
@@ -96,6 +104,7 @@ private:
   } state;
   bool was_clicked;
   uint32_t last_state_change;
+  uint32_t pressed_since;
 };
 
 #endif
@@ -33,6 +33,10 @@
 #include "AudioOutputI2SNoDAC.h"
 #include "AudioOutputI2S.h"
 #include "InterruptableOutput.h"
+#include "CueMixer.h"
+#include "Scrubber.h"
+#include "LoudnessAnalyzer.h"
+#include "Manifest.h"
 
 #include "config.h"
 
@@ -40,10 +44,13 @@ AudioFileSourceSD *file;
 AudioGeneratorMP3 *mp3;
 AudioFileSourceBuffer *buff;
 AudioOutput *realout;
+CueMixer *mixer;
 InterruptableOutput *out;
+Scrubber *scrubber;
 
 const char resumefile[] = "/resume.txt";
 void resumeSession();
+void restoreTagsBackup();
 
 SPIClass sdspi(HSPI);
 File root;
@@ -53,6 +60,7 @@ MFRC522 mfrc522(MFRC522_CS_PIN, MFRC522_RST_PIN);
 Button<20, 500> b_forward, b_rewind;
 SemaphoreHandle_t control_mutex;
 void uiloop(void *);
+void statusCue(StatusIndicator::StatusBits which);
 
 void setup() {
   pinMode(POWER_CONTROL_PIN, OUTPUT);
@@ -71,9 +79,12 @@ void setup() {
   mfrc522.PCD_Init();		// Init MFRC522
   mfrc522.PCD_DumpVersionToSerial();	// Show details of PCD - MFRC522 Card Reader details
 
-  if (!SD.begin(15, sdspi)) {
+  bool sd_ok = SD.begin(15, sdspi);
+  if (!sd_ok) {
     Serial.println("SD card initialization failed!");
     indicator.setPermanentStatus(StatusIndicator::Error);
+  } else {
+    restoreTagsBackup();
   }
 
   Serial.println("Hardware init complete");
@@ -91,8 +102,13 @@ void setup() {
 #error No output mode defined in config.h
 #endif
 
-  out = new InterruptableOutput(realout);
+  mixer = new CueMixer(realout);
+  out = new InterruptableOutput(mixer);
   mp3 = new AudioGeneratorMP3();
+  scrubber = new Scrubber(out, buff, file);
+
+  if (sd_ok) mixer->loadCues(mp3);
+  indicator.setStatusHook(statusCue);
 
   if (SD.exists(resumefile)) {
     resumeSession();
@@ -101,6 +117,12 @@ void setup() {
   control_mutex = xSemaphoreCreateMutex();
   // Handle controls in separate task. Esp. reading RFID tags takes too long, causes hickups in the playback, if used in the same thread.
   xTaskCreate(uiloop, "ui", 10000, NULL, 1, NULL);
+
+  if (sd_ok) {
+    loudness.begin();
+    manifest.begin();
+    background.begin();
+  }
 }
 
 // four bits to hex notation. Only for values between 0 and 15, obviously.
@@ -109,6 +131,15 @@ char bitsToHex (byte bits) {
   return ('a') + (bits - 10);
 }
 
+// Play audio cues for (some) status changes. Kids can't always see the LED.
+void statusCue(StatusIndicator::StatusBits which) {
+  if (which == StatusIndicator::PlaylistEnd) mixer->trigger(CueMixer::EndOfPlaylist);
+  else if (which == StatusIndicator::BatteryLow) mixer->trigger(CueMixer::BatteryLow);
+  else if (which == StatusIndicator::TagRecognized) mixer->trigger(CueMixer::TagRecognized);
+  else if (which == StatusIndicator::SeekLimit) mixer->trigger(CueMixer::SeekLimit);
+  else if (which == StatusIndicator::Error) mixer->trigger(CueMixer::Error);
+}
+
 String uidToString(const MFRC522::Uid &uid) {
   String ret;
   for (int i = 0; i < uid.size; ++i) {
@@ -119,7 +150,7 @@ String uidToString(const MFRC522::Uid &uid) {
 }
 
 struct ControlsState {
-  ControlsState() { volume = 0; navigation = None; }
+  ControlsState() { volume = 0; navigation = None; scrub = 0; held_ms = 0; }
   String uid;
   bool haveTag() const {
     return (uid.length() > 0);
@@ -128,10 +159,10 @@ struct ControlsState {
   enum {
     NextTrack,
     PreviousTrack,
-    FastForward,
-    Rewind,
     None
   } navigation;
+  int scrub;         // 1 while forward button is held, -1 while rewind button is held, 0 otherwise
+  uint32_t held_ms;  // for how long the button has been held
 } controls;
 
 struct PlayerState {
@@ -251,9 +282,16 @@ void uiloop(void *) {
     // Much easier to handle clicks with mutex locked
     controls_copy.navigation = controls.navigation;
     if (b_forward.wasClicked()) controls_copy.navigation = ControlsState::NextTrack;
-    else if (b_forward.isHeld()) controls_copy.navigation = ControlsState::FastForward;
     else if (b_rewind.wasClicked()) controls_copy.navigation = ControlsState::PreviousTrack;
-    else if (b_rewind.isHeld()) controls_copy.navigation = ControlsState::Rewind;
+    controls_copy.scrub = 0;
+    controls_copy.held_ms = 0;
+    if (b_forward.isHeld()) {
+      controls_copy.scrub = 1;
+      controls_copy.held_ms = b_forward.heldFor();
+    } else if (b_rewind.isHeld()) {
+      controls_copy.scrub = -1;
+      controls_copy.held_ms = b_rewind.heldFor();
+    }
 
     controls = controls_copy;
     xSemaphoreGive(control_mutex);
@@ -266,6 +304,7 @@ void uiloop(void *) {
 void stopPlaying() {
   out->stop();
   state.playing = false;
+  background.setPaused(false);
   indicator.setPermanentStatus(StatusIndicator::Playing, false);
   if (!isWebInterfaceActive()) state.idle_since = millis();
 }
@@ -278,13 +317,19 @@ void startTrack(String track) {
   if (mp3->isRunning()) mp3->stop();
   if (track.length() && file->open(track.c_str())) {
     buff->seek(0, SEEK_SET);
+    mixer->setTrackGain(LoudnessAnalyzer::trackGain(track, file->getSize()));
     mp3->begin(buff, out);
     state.finished = false;
   } else {
-    Serial.print("Empty track. stopping...");
+    Serial.print(track.length() ? "Failed to open track. stopping..." : "Empty track. stopping...");
     stopPlaying();
     state.finished = true;
-    indicator.setTransientStatus(StatusIndicator::AtFileEOF);
+    if (track.length()) {
+      indicator.setTransientStatus(StatusIndicator::Error);  // e.g. the track was removed from the card
+    } else if (!state.list.isEmpty()) {
+      // A tag without any tracks (e.g. the wifi master tag) has no playlist to end, and should keep its own cue
+      indicator.setTransientStatus(StatusIndicator::PlaylistEnd);
+    }
     Serial.println(" stopped.");
   }
 }
@@ -302,6 +347,13 @@ String readLine(File &f) {
 
 const char* TAGS_FILE = "/tags.txt";
 
+/** If we lost power while a sync was replacing tags.txt, only the backup of the previous version may be left. */
+void restoreTagsBackup() {
+  if (SD.exists(TAGS_FILE) || !SD.exists(TAGS_BACKUP)) return;
+  Serial.println("Restoring tags.txt from backup");
+  SD.rename(TAGS_BACKUP, TAGS_FILE);
+}
+
 File findNextUnassignedMP3Folder(const std::vector<String> &known_directories, File dir=SD.open("/")) {
   Serial.print("Scanning for unassigned mp3-dir ");
   Serial.println(dir.name());
@@ -423,6 +475,7 @@ void startOrResumePlaying() {
   if (controls.uid == state.uid) {  // resume previous
   } else {  // new tag
     loadPlaylistForUid(controls.uid);
+    if (!state.list.isEmpty() || state.list.wifi_enabled) indicator.setTransientStatus(StatusIndicator::TagRecognized);
     startTrack(state.list.next());
     state.uid = controls.uid;
   }
@@ -432,53 +485,13 @@ void startOrResumePlaying() {
   }
 
   if (!state.finished) {
+    background.setPaused(true);
     out->begin();
     state.playing = true;
     indicator.setPermanentStatus(StatusIndicator::Playing);
   }
 }
 
-void seek(int dir) {
-  // We're spending quite some time in this function, and don't need to check controls, so release the mutex
-  xSemaphoreGive(control_mutex);
-
-  int timeconst = out->getRate() / 10;
-
-  // First, fade out the volume to avoid noise.
-  // While doing so, measure input consumption as a crude estimate for how far to seek.
-  uint32_t opos = buff->getPos();
-  out->fadeOut(timeconst);
-  while (out->isSpecialModeActive() && mp3->isRunning()) mp3->loop();
-  int32_t npos = buff->getPos();
-  int32_t delta = (npos - opos) * 32;
-  if (delta < 50) delta = buff->getSize() / 50;  // Fallback, if delta seems off
-  npos += delta * dir;
-  if (dir < 0) npos -= (timeconst*4 + 1152); // For rewind, substract the total size that we are playing forward during seek
-  if (npos < 0) {
-    indicator.setTransientStatus(StatusIndicator::AtFileEOF);
-    npos = 0;
-  }
-  if (npos >= buff->getSize()) {
-    indicator.setTransientStatus(StatusIndicator::AtFileEOF);
-    npos = buff->getSize() - 1;
-  }
-  buff->seek(npos, SEEK_SET);
-
-  // Insert a brief silence to avoid noise while the mp3-stream seeks to the next frame
-  out->setSwallow(1152);   // NOTE: The *typical* mp3 frame length is 1152
-  while (out->isSpecialModeActive() && mp3->isRunning()) mp3->loop();
-
-  // Fade in, again
-  out->fadeIn(timeconst);
-  while (out->isSpecialModeActive() && mp3->isRunning()) mp3->loop();
-
-  // Now play a brief sample a regular speed, a) For auditive feedback, b) as a defined rate-limit for the seeking
-  out->setTimeout(timeconst*2);   // Play a brief sample at regular volume and speed for auditive feedback
-  while (out->isSpecialModeActive() && mp3->isRunning()) mp3->loop();
-
-  xSemaphoreTake(control_mutex, portMAX_DELAY);
-}
-
 void loop() {
   static int vol = controls.volume;
   xSemaphoreTake(control_mutex, portMAX_DELAY);
@@ -491,6 +504,7 @@ void loop() {
       startOrResumePlaying();
     } else {
       if (controls.navigation == ControlsState::None) {
+        scrubber->update(controls.scrub, controls.held_ms);
         if (!mp3->isRunning() || !mp3->loop()) {
           indicator.setTransientStatus(StatusIndicator::AtFileEOF);
           startTrack(state.list.next());
@@ -502,10 +516,6 @@ void loop() {
           String prev = state.list.previous();
           if (prev.length() < 1) prev = state.list.next();  // no previous track: re-start first
           startTrack(prev);
-        } else if (controls.navigation == ControlsState::FastForward) {
-          seek(1);
-        } else {
-          seek(-1);
         }
         controls.navigation = ControlsState::None;  // signal to ui thread that we have seen the button
       }
@@ -521,6 +531,7 @@ void loop() {
     stopWebInterface();
   }
   xSemaphoreGive(control_mutex);
+  if (!state.playing) mixer->pump();  // play any pending audio cue, even while no track is playing
   if (!state.playing && !isWebInterfaceActive()) {
     if (state.idle_since) {
       if ((millis() - state.idle_since) > (IDLE_SHUTDOWN_TIMEOUT * 1000UL)) {
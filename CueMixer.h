@@ -0,0 +1,268 @@
+// kate: space-indent on; indent-width 2; mixedindent off; indent-mode cstyle;
+/*
+ *  The Closed Player - Kid-friendly MP3 player based on RFID tags
+ *  
+ *  See README.md for details and hardware setup.
+ *  
+ *  Copyright (c) 2019 Thomas Friedrichsmeier
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *  
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *  
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef CUEMIXER_H
+#define CUEMIXER_H
+
+#include <SD.h>
+#include <vector>
+#include <atomic>
+#include "AudioOutput.h"
+#include "AudioFileSourceSD.h"
+#include "AudioGeneratorMP3.h"
+
+#include "config.h"
+
+/** A short sound, decoded to mono 16 bit samples, and kept in RAM. */
+struct AudioCue {
+  AudioCue() { rate = 0; }
+  std::vector<int16_t> samples;
+  uint16_t rate;
+};
+
+/** Helper for decoding cues: Simply records the (downmixed) samples it is fed. If cue is 0, samples are only counted. */
+class CueRecorder : public AudioOutput {
+public:
+  CueRecorder(AudioCue *cue, uint32_t max_samples) {
+    _cue = cue;
+    _max_samples = max_samples;
+    _count = 0;
+    hertz = 0;
+  }
+  bool begin() override { return true; }
+  bool stop() override { return true; }
+  bool ConsumeSample(int16_t sample[2]) override {
+    if (isFull()) return false;  // makes the generator return from loop(), so the caller can stop decoding
+    ++_count;
+    if (!_cue) return true;
+    int16_t s[2] = { sample[0], sample[1] };
+    MakeSampleStereo16(s);
+    _cue->rate = hertz;
+    _cue->samples.push_back((s[0] + s[1]) / 2);
+    return true;
+  }
+  bool isFull() const {
+    return _count >= _max_samples;
+  }
+  uint32_t count() const {
+    return _count;
+  }
+private:
+  AudioCue *_cue;
+  uint32_t _max_samples;
+  uint32_t _count;
+};
+
+/** Sits between the generator and the real output, and mixes short audio cues (e.g. "end of playlist")
+ *  into the stream. Cues are decoded once, at boot, so triggering one does not touch the SD card.
+ *  Mixing is done in fixed point, with short attack / release ramps on the cue, and the stream ducked
+ *  while the cue is playing. When no stream is playing, call pump() to play cues on their own.
+ *  Also applies the per-track gain for loudness normalization (see LoudnessAnalyzer.h). */
+class CueMixer : public AudioOutput {
+public:
+  enum Cue {
+    EndOfPlaylist,
+    BatteryLow,
+    TagRecognized,
+    SeekLimit,
+    Error,
+    CueCount
+  };
+  CueMixer(AudioOutput *out) {
+    _out = out;
+    hertz = 44100;
+    current = -1;
+    pending = -1;
+    track_gain = 4096;
+    sink_active = false;
+    pumping = false;
+  }
+
+  /** Decode all cues from the SD card, using the given generator. To be called once at boot,
+   *  before playback starts. Cues that are missing from the card will simply stay silent. All cues
+   *  together get at most CUE_TOTAL_SAMPLES, and each cue is decoded twice, so exactly the needed
+   *  amount of memory can be reserved, up front. */
+  void loadCues(AudioGeneratorMP3 *gen) {
+    static const char* const files[CueCount] = {
+      CUE_DIR "/end.mp3",
+      CUE_DIR "/battery.mp3",
+      CUE_DIR "/tag.mp3",
+      CUE_DIR "/limit.mp3",
+      CUE_DIR "/error.mp3"
+    };
+    uint32_t budget = CUE_TOTAL_SAMPLES;
+    for (int i = 0; i < CueCount; ++i) {
+      if (!budget || !SD.exists(files[i])) continue;
+      CueRecorder counter(0, budget);
+      decodeCue(gen, files[i], &counter);
+      if (!counter.count()) continue;
+      cues[i].samples.reserve(counter.count());
+      CueRecorder rec(&cues[i], counter.count());
+      decodeCue(gen, files[i], &rec);
+      if (!cues[i].rate) cues[i].samples = std::vector<int16_t>();
+      budget -= cues[i].samples.size();
+      Serial.print("Loaded cue ");
+      Serial.print(files[i]);
+      Serial.print(": ");
+      Serial.print(cues[i].samples.size());
+      Serial.println(" samples");
+    }
+  }
+
+  /** Start playing the given cue (replacing any other cue currently playing). Safe to call from any thread,
+   *  the cue will be picked up with the next sample. Triggering the cue that is already playing (or about to
+   *  start) does nothing, so repeated triggers will not make it stutter. */
+  void trigger(Cue which) {
+    if (cues[which].samples.empty()) return;
+    if (current == which || pending == which) return;
+    pending = which;
+  }
+
+  bool isCueActive() const {
+    return (current >= 0 || pending >= 0);
+  }
+
+  /** While no stream is playing, nobody is feeding samples into this output. Call this regularly in
+   *  that case, to play cues between tracks. Starts and stops the real output as needed. */
+  void pump() {
+    if (sink_active) return;  // the stream is in charge
+    if (!isCueActive()) {
+      if (pumping) {
+        _out->stop();
+        pumping = false;
+      }
+      return;
+    }
+    if (!pumping) {
+      _out->SetRate(hertz);
+      _out->begin();
+      pumping = true;
+    }
+    int16_t silence[2] = { 0, 0 };
+    while (isCueActive() && ConsumeSample(silence)) {}
+  }
+
+  bool ConsumeSample(int16_t sample[2]) override {
+    // NOTE: A plain load, first, as the atomic exchange is comparatively expensive, and this runs for every sample
+    if (pending.load(std::memory_order_relaxed) >= 0) {
+      int8_t p = pending.exchange(-1);  // atomic, so a trigger from another thread cannot get lost in between
+      if (p >= 0) startCue(p);
+    }
+    if (current < 0 && track_gain == 4096) return _out->ConsumeSample(sample);
+
+    int32_t gain = track_gain;
+    int32_t c = 0;
+    if (current >= 0) {
+      const AudioCue &cue = cues[current];
+      int32_t idx = pos >> 16;
+      int32_t rem = cue.samples.size() - idx;
+      int32_t env = 32767;
+      if (idx * attack_step < env) env = idx * attack_step;
+      if (rem * release_step < env) env = rem * release_step;
+
+      c = (cue.samples[idx] * env) >> 15;
+      gain = (gain * (32767 - ((env * CUE_DUCK_DEPTH) >> 15))) >> 15;
+    }
+    int16_t mixed[2];
+    for (int i = 0; i < 2; ++i) {
+      int32_t s = ((sample[i] * gain) >> 12) + c;
+      if (s > 32767) s = 32767;
+      else if (s < -32768) s = -32768;
+      mixed[i] = s;
+    }
+
+    // NOTE: Position is advanced only once the sample was accepted. Otherwise, we'll be called with the same sample, again.
+    if (!_out->ConsumeSample(mixed)) return false;
+    if (current >= 0) {
+      pos += step;
+      if ((pos >> 16) >= cues[current].samples.size()) current = -1;
+    }
+    return true;
+  }
+
+  /** Gain to apply to the stream (but not the cues), in 12 bit fixed point, i.e. 4096 means unity gain.
+   *  Applied ahead of the volume setting of the real output. */
+  void setTrackGain(int32_t gain) {
+    track_gain = gain;
+  }
+
+  bool SetRate(int hz) override {
+    hertz = hz;
+    return _out->SetRate(hz);
+  }
+  bool SetBitsPerSample(int bits) override {
+    bps = bits;
+    return _out->SetBitsPerSample(bits);
+  }
+  bool SetChannels(int chan) override {
+    channels = chan;
+    return _out->SetChannels(chan);
+  }
+  bool SetGain(float f) override {
+    return _out->SetGain(f);
+  }
+  bool begin() override {
+    sink_active = true;
+    pumping = false;
+    return _out->begin();
+  }
+  bool stop() override {
+    sink_active = false;
+    return _out->stop();
+  }
+private:
+  static void decodeCue(AudioGeneratorMP3 *gen, const char *file, CueRecorder *rec) {
+    AudioFileSourceSD src;
+    if (!src.open(file)) return;
+    gen->begin(&src, rec);
+    while (gen->isRunning() && !rec->isFull()) {
+      if (!gen->loop()) break;
+    }
+    gen->stop();
+  }
+
+  void startCue(int8_t which) {
+    const AudioCue &cue = cues[which];
+    step = (((uint32_t) cue.rate) << 16) / (hertz ? hertz : 44100);
+    if (!step) step = 1;
+    pos = 0;
+    // ramp lengths are in cue samples, so no division is needed per output sample
+    int32_t attack_len = (int32_t) cue.rate * CUE_ATTACK_MS / 1000;
+    int32_t release_len = (int32_t) cue.rate * CUE_RELEASE_MS / 1000;
+    attack_step = attack_len > 0 ? 32767 / attack_len : 32767;
+    release_step = release_len > 0 ? 32767 / release_len : 32767;
+    current = which;
+  }
+
+  AudioOutput *_out;
+  AudioCue cues[CueCount];
+  std::atomic<int8_t> pending;
+  volatile int8_t current;  // only written from the audio thread
+  uint32_t pos;  // 16.16 fixed point position inside the current cue
+  uint32_t step;
+  int32_t track_gain;
+  int32_t attack_step;
+  int32_t release_step;
+  bool sink_active;
+  bool pumping;
+};
+
+#endif
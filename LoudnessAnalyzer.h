@@ -0,0 +1,242 @@
+// kate: space-indent on; indent-width 2; mixedindent off; indent-mode cstyle;
+/*
+ *  The Closed Player - Kid-friendly MP3 player based on RFID tags
+ *  
+ *  See README.md for details and hardware setup.
+ *  
+ *  Copyright (c) 2019 Thomas Friedrichsmeier
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *  
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *  
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef LOUDNESSANALYZER_H
+#define LOUDNESSANALYZER_H
+
+#include <SD.h>
+#include <vector>
+#include "AudioOutput.h"
+#include "AudioFileSourceSD.h"
+#include "AudioGeneratorMP3.h"
+#include "BackgroundWorker.h"
+
+#include "config.h"
+
+// Per-directory index of analyzed tracks. Lines are: NAME\tSIZE\tLOUDNESS\tPEAK
+const char LOUDNESS_INDEX[] = "loudness.txt";
+const char LOUDNESS_TMP[] = "loudness.tmp";
+#define LOUDNESS_SILENT -1000  // Loudness value recorded for tracks without any audible blocks
+
+/** Measures the loudness (mean power over 400ms blocks, ignoring near-silent blocks; i.e. roughly like EBU R128, but without
+ *  K-weighting and relative gate) and peak of the samples it is fed. Nothing is played. */
+class LoudnessMeter : public AudioOutput {
+public:
+  LoudnessMeter() {
+    hertz = 44100;
+    since_yield = 0;
+    peak = 0;
+    block_sum = 0;
+    block_count = 0;
+    gated_sum = 0;
+    gated_blocks = 0;
+  }
+  bool begin() override { return true; }
+  bool stop() override { return true; }
+  bool ConsumeSample(int16_t sample[2]) override {
+    // Refuse a sample every now and then, so the generator returns from loop(), and the caller gets a chance to check for playback
+    if (++since_yield > 2048) {
+      since_yield = 0;
+      return false;
+    }
+    int16_t s[2] = { sample[0], sample[1] };
+    MakeSampleStereo16(s);
+    int32_t m = (s[0] + s[1]) / 2;
+    if (abs(m) > peak) peak = abs(m);
+    block_sum += m * m;
+    if (++block_count >= (hertz * 2 / 5)) {
+      uint32_t mean = block_sum / block_count;
+      if (mean >= 107) {  // absolute gate at -70dBFS
+        gated_sum += mean;
+        ++gated_blocks;
+      }
+      block_sum = 0;
+      block_count = 0;
+    }
+    return true;
+  }
+  /** Integrated loudness in 1/10 dBFS */
+  int16_t getLoudness() const {
+    if (!gated_blocks) return LOUDNESS_SILENT;
+    float mean = ((float) gated_sum) / gated_blocks;
+    return (int16_t) (100 * log10f(mean / (32768.0f * 32768.0f)));
+  }
+  uint16_t getPeak() const {
+    return peak;
+  }
+private:
+  uint16_t since_yield;
+  uint16_t peak;
+  uint64_t block_sum;
+  uint32_t block_count;
+  uint64_t gated_sum;
+  uint32_t gated_blocks;
+};
+
+/** Analyzes the loudness of all tracks on the card in the background (see BackgroundWorker), so that volume can be
+ *  normalized across tracks. Results are stored per directory, track by track, so analysis simply continues where it
+ *  left off after a power cycle. A track being analyzed when interrupted will be started over, later. */
+class LoudnessAnalyzer : public BackgroundJob {
+public:
+  void begin() {
+    background.addJob(this);
+    requestScan();
+  }
+
+  /** Look up the gain for the given track, in 12 bit fixed point (4096 meaning unity gain). Tracks that have not
+   *  been analyzed, yet, are played at unity gain. */
+  static int32_t trackGain(const String &track, uint32_t size) {
+    int slash = track.lastIndexOf('/');
+    String key = track.substring(slash + 1) + '\t' + String(size) + '\t';
+    File index = SD.open(indexPath(track.substring(0, slash)));
+    while (index && index.available()) {
+      String line = index.readStringUntil('\n');
+      if (!line.startsWith(key)) continue;
+      int tab = line.indexOf('\t', key.length());
+      if (tab < 0) continue;
+      int loudness = line.substring(key.length(), tab).toInt();
+      int peak = line.substring(tab + 1).toInt();
+      index.close();
+      return gainFor(loudness, peak);
+    }
+    return 4096;
+  }
+private:
+  static int32_t gainFor(int loudness, int peak) {
+    if (loudness <= LOUDNESS_SILENT) return 4096;
+    float db = NORMALIZE_TARGET_DB - loudness / 10.0f;
+    if (db > NORMALIZE_MAX_BOOST_DB) db = NORMALIZE_MAX_BOOST_DB;
+    if (db < -NORMALIZE_MAX_CUT_DB) db = -NORMALIZE_MAX_CUT_DB;
+    float gain = powf(10, db / 20);
+    if (peak > 0 && gain * peak > 32767) gain = 32767.0f / peak;  // don't clip
+    return gain * 4096;
+  }
+
+  static String indexPath(const String &dir, const char *file=LOUDNESS_INDEX) {
+    if (dir.endsWith("/")) return dir + file;
+    return dir + "/" + file;
+  }
+
+  struct IndexRow {
+    String key;   // NAME\tSIZE
+    String line;
+    bool used;    // whether the track still exists, as is
+  };
+
+  bool run() override {
+    return scanDir(SD.open("/"));
+  }
+  const char* name() const override {
+    return "loudness analysis";
+  }
+
+  /** Analyze all tracks in dir that are not in the index, yet, recursively. Returns false, if interrupted.
+   *  Once the directory is complete, rows for tracks that have been removed or changed are dropped from the index. */
+  bool scanDir(File dir) {
+    if (!dir) return true;
+    String index_path = indexPath(dir.name());
+
+    // Read rows of tracks that have already been analyzed
+    std::vector<IndexRow> rows;
+    File index = SD.open(index_path);
+    while (index && index.available()) {
+      String line = index.readStringUntil('\n');
+      if (line.endsWith("\r")) line.remove(line.length() - 1);
+      int tab = line.indexOf('\t', line.indexOf('\t') + 1);
+      if (tab > 0) rows.push_back(IndexRow { line.substring(0, tab), line, false });
+    }
+    index.close();
+
+    File entry = dir.openNextFile();
+    while (entry) {
+      if (background.shouldYield()) return false;
+      String path = entry.name();
+      if (entry.isDirectory()) {
+        if (path != SYNC_STAGING_DIR && !scanDir(entry)) return false;
+      } else {
+        String n = path;
+        n.toLowerCase();
+        String key = path.substring(path.lastIndexOf('/') + 1) + '\t' + String(entry.size());
+        bool known = false;
+        for (unsigned int i = 0; i < rows.size(); ++i) {
+          if (rows[i].key == key) rows[i].used = known = true;
+        }
+        if (n.endsWith(".mp3") && !known) {
+          LoudnessMeter meter;
+          if (!measure(path, &meter)) return false;
+          Serial.print("Loudness of ");
+          Serial.print(path);
+          Serial.print(": ");
+          Serial.println(meter.getLoudness());
+
+          String line = key + '\t' + String(meter.getLoudness()) + '\t' + String(meter.getPeak());
+          File out = SD.open(index_path, FILE_WRITE);
+          out.seek(out.size());  // Contrary to documentation, FILE_WRITE does not seem to imply APPEND?!
+          out.println(line);
+          out.close();
+          rows.push_back(IndexRow { key, line, true });
+        }
+      }
+      entry = dir.openNextFile();
+    }
+
+    bool stale = false;
+    for (unsigned int i = 0; i < rows.size(); ++i) {
+      if (!rows[i].used) stale = true;
+    }
+    if (stale) {
+      // Write to a temporary file, first, so the index is never lost, halfway
+      String tmp_path = indexPath(dir.name(), LOUDNESS_TMP);
+      SD.remove(tmp_path);
+      File out = SD.open(tmp_path, FILE_WRITE);
+      for (unsigned int i = 0; i < rows.size(); ++i) {
+        if (rows[i].used) out.println(rows[i].line);
+      }
+      out.close();
+      SD.remove(index_path);
+      SD.rename(tmp_path, index_path);
+    }
+    return true;
+  }
+
+  /** Decode the given track (as fast as possible) into meter. Returns false, if interrupted. */
+  bool measure(const String &path, LoudnessMeter *meter) {
+    AudioFileSourceSD src;
+    if (!src.open(path.c_str())) return true;
+    AudioGeneratorMP3 gen;
+    gen.begin(&src, meter);
+    uint16_t chunks = 0;
+    while (gen.isRunning()) {
+      if (background.shouldYield()) {
+        gen.stop();
+        return false;
+      }
+      if (!gen.loop()) break;
+      if (!(++chunks % 16)) vTaskDelay(1);  // Give other tasks on this core a chance, even at same priority
+    }
+    gen.stop();
+    return true;
+  }
+};
+
+LoudnessAnalyzer loudness;
+
+#endif
@@ -0,0 +1,348 @@
+// kate: space-indent on; indent-width 2; mixedindent off; indent-mode cstyle;
+/*
+ *  The Closed Player - Kid-friendly MP3 player based on RFID tags
+ *  
+ *  See README.md for details and hardware setup.
+ *  
+ *  Copyright (c) 2019 Thomas Friedrichsmeier
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *  
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *  
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef MANIFEST_H
+#define MANIFEST_H
+
+#include <SD.h>
+#include <MD5Builder.h>
+#include <vector>
+#include <algorithm>
+#include "LoudnessAnalyzer.h"
+#include "BackgroundWorker.h"
+
+#include "config.h"
+
+// Per-directory cache of content hashes. Lines are: NAME\tSIZE\tMTIME\tMD5
+const char MANIFEST_INDEX[] = "manifest.txt";
+const char MANIFEST_TMP[] = "manifest.tmp";
+// While tags.txt is being replaced by a sync, the previous version is kept, here. Restored at boot, if needed.
+const char TAGS_BACKUP[] = "/tags.bak";
+
+// The caches are read and written from the background worker as well as the web interface, so all access (and in
+// particular read-modify-write sequences) must hold this lock. See CacheLock, below.
+SemaphoreHandle_t manifest_cache_mutex = xSemaphoreCreateMutex();
+
+struct ManifestEntry {
+  String name;  // name only, inside a directory cache, full path elsewhere
+  uint32_t size;
+  uint32_t mtime;
+  String md5;
+};
+
+/** Keeps track of path, size, modification time and MD5 hash of all files on the card, for syncing. Hashes are computed
+ *  while uploading, where possible. Any other files (e.g. copied to the card, directly) are hashed in the background
+ *  (see BackgroundWorker). Results are cached per directory. */
+class Manifest : public BackgroundJob {
+public:
+  Manifest() {
+    complete = false;
+  }
+  void begin() {
+    background.addJob(this);
+    requestScan();
+  }
+  /** Whether the hashes of all files are known (as far as the last scan could tell). */
+  bool isComplete() const {
+    return complete && !run_requested;
+  }
+
+  /** Files managed by the player, itself, which are not part of the manifest */
+  static bool isMetaFile(const String &path) {
+    String name = baseName(path);
+    if (name == MANIFEST_INDEX || name == MANIFEST_TMP || name == LOUDNESS_INDEX || name == LOUDNESS_TMP) return true;
+    return (path == "/resume.txt" || path == TAGS_BACKUP || path.startsWith(SYNC_STAGING_DIR));
+  }
+  static String dirName(const String &path) {
+    return path.substring(0, path.lastIndexOf('/'));
+  }
+  static String baseName(const String &path) {
+    return path.substring(path.lastIndexOf('/') + 1);
+  }
+
+  /** The cache of a single directory, for checking many files of the same directory in a row. */
+  struct DirCache {
+    DirCache() { loaded = false; }
+    String dir;
+    bool loaded;
+    std::vector<ManifestEntry> entries;
+  };
+
+  /** Check whether the file at path (full path) exists with the given md5. The cache of its directory is kept in
+   *  dir_cache, so checking files sorted by path reads each directory cache only once. */
+  static bool isUpToDate(const String &path, const String &md5, DirCache *dir_cache) {
+    String dir = dirName(path);
+    if (!dir_cache->loaded || dir_cache->dir != dir) {
+      dir_cache->entries.clear();
+      CacheLock lock;
+      readCache(dir, &dir_cache->entries);
+      dir_cache->dir = dir;
+      dir_cache->loaded = true;
+    }
+    File f = SD.open(path);
+    if (!f || f.isDirectory()) return false;
+    int c = findFresh(dir_cache->entries, f);
+    return (c >= 0 && dir_cache->entries[c].md5 == md5);
+  }
+
+  /** Record the hashes of the given files (full paths; e.g. computed while uploading). Each directory cache is
+   *  rewritten once, only. */
+  static void update(std::vector<ManifestEntry> files) {
+    sortByPath(&files);
+    size_t i = 0;
+    while (i < files.size()) {
+      String dir = dirName(files[i].name);
+      CacheLock lock;
+      std::vector<ManifestEntry> cache;
+      readCache(dir, &cache);
+      for (; i < files.size() && dirName(files[i].name) == dir; ++i) {
+        File f = SD.open(files[i].name);
+        if (!f) continue;
+        ManifestEntry e = { baseName(files[i].name), (uint32_t) f.size(), (uint32_t) f.getLastWrite(), files[i].md5 };
+        f.close();
+        int c = find(cache, e.name);
+        if (c < 0) cache.push_back(e);
+        else cache[c] = e;
+      }
+      writeCache(dir, cache);
+    }
+  }
+
+  /** Drop the given file from the cache */
+  static void remove(const String &path) {
+    CacheLock lock;
+    std::vector<ManifestEntry> cache;
+    readCache(dirName(path), &cache);
+    int c = find(cache, baseName(path));
+    if (c < 0) return;
+    cache.erase(cache.begin() + c);
+    writeCache(dirName(path), cache);
+  }
+
+  /** Compute MD5 hash of a file. Returns an empty string, if the file could not be read, or (if interruptible) the
+   *  background worker should yield. */
+  static String hashFile(const String &path, bool interruptible = false) {
+    File f = SD.open(path);
+    if (!f) return String();
+    MD5Builder md5;
+    md5.begin();
+    uint8_t buf[2048];
+    while (f.available()) {
+      if (interruptible && background.shouldYield()) return String();
+      size_t n = f.read(buf, sizeof(buf));
+      md5.add(buf, n);
+    }
+    md5.calculate();
+    return md5.toString();
+  }
+private:
+  friend class ManifestLister;
+  struct CacheLock {
+    CacheLock() { xSemaphoreTake(manifest_cache_mutex, portMAX_DELAY); }
+    ~CacheLock() { xSemaphoreGive(manifest_cache_mutex); }
+  };
+
+  static String cachePath(const String &dir, const char *name) {
+    if (dir.endsWith("/")) return dir + name;
+    return dir + "/" + name;
+  }
+
+  static void readCache(const String &dir, std::vector<ManifestEntry> *entries) {
+    File f = SD.open(cachePath(dir, MANIFEST_INDEX));
+    while (f && f.available()) {
+      String line = f.readStringUntil('\n');
+      if (line.endsWith("\r")) line.remove(line.length() - 1);
+      int tab1 = line.indexOf('\t');
+      int tab2 = line.indexOf('\t', tab1 + 1);
+      int tab3 = line.indexOf('\t', tab2 + 1);
+      if (tab1 < 0 || tab2 < 0 || tab3 < 0) continue;
+      ManifestEntry e = { line.substring(0, tab1), (uint32_t) line.substring(tab1 + 1, tab2).toInt(), (uint32_t) line.substring(tab2 + 1, tab3).toInt(), line.substring(tab3 + 1) };
+      entries->push_back(e);
+    }
+  }
+
+  /** Write the cache for dir. Written to a temporary file, first, so a power loss will not leave a half-written cache. */
+  static void writeCache(const String &dir, const std::vector<ManifestEntry> &entries) {
+    String tmp = cachePath(dir, MANIFEST_TMP);
+    String path = cachePath(dir, MANIFEST_INDEX);
+    SD.remove(tmp);
+    if (!entries.empty()) {
+      File f = SD.open(tmp, FILE_WRITE);
+      for (unsigned int i = 0; i < entries.size(); ++i) {
+        f.printf("%s\t%u\t%u\t%s\n", entries[i].name.c_str(), entries[i].size, entries[i].mtime, entries[i].md5.c_str());
+      }
+      f.close();
+    }
+    SD.remove(path);
+    if (!entries.empty()) SD.rename(tmp, path);
+  }
+
+  static int find(const std::vector<ManifestEntry> &entries, const String &name) {
+    for (unsigned int i = 0; i < entries.size(); ++i) {
+      if (entries[i].name == name) return i;
+    }
+    return -1;
+  }
+
+  /** Find the cache entry for file, but only, if it is still up to date */
+  static int findFresh(const std::vector<ManifestEntry> &entries, File &file) {
+    int i = find(entries, baseName(file.name()));
+    if (i < 0) return -1;
+    if (entries[i].size != file.size() || entries[i].mtime != (uint32_t) file.getLastWrite()) return -1;
+    return i;
+  }
+
+  static void sortByPath(std::vector<ManifestEntry> *entries) {
+    std::sort(entries->begin(), entries->end(), [](const ManifestEntry &a, const ManifestEntry &b) { return a.name < b.name; });
+  }
+
+  bool run() override {
+    complete = false;
+    complete = refreshDir(SD.open("/"));
+    return complete;
+  }
+  const char* name() const override {
+    return "manifest";
+  }
+
+  /** Hash all files in dir that are not in the cache (or have changed), recursively. The cache is written after each
+   *  file, so no work is lost, if interrupted. Returns false, if interrupted. */
+  bool refreshDir(File dir) {
+    if (!dir) return true;
+    String dirname = dir.name();
+    std::vector<ManifestEntry> cache;
+    {
+      CacheLock lock;
+      readCache(dirname, &cache);
+    }
+
+    File entry = dir.openNextFile();
+    while (entry) {
+      if (background.shouldYield()) return false;
+      String path = entry.name();
+      if (isMetaFile(path)) {
+        // skip
+      } else if (entry.isDirectory()) {
+        if (!refreshDir(entry)) return false;
+      } else {
+        if (findFresh(cache, entry) < 0) {
+          String md5 = hashFile(path, true);
+          if (background.shouldYield()) return false;
+          if (md5.length()) {
+            ManifestEntry e = { baseName(path), (uint32_t) entry.size(), (uint32_t) entry.getLastWrite(), md5 };
+            // Hashing takes a while. Re-read the cache, as the web interface may have updated it, meanwhile.
+            CacheLock lock;
+            cache.clear();
+            readCache(dirname, &cache);
+            int c = find(cache, e.name);
+            if (c < 0) cache.push_back(e);
+            else cache[c] = e;
+            writeCache(dirname, cache);
+          }
+        }
+      }
+      entry = dir.openNextFile();
+    }
+
+    // Drop entries for files that are gone
+    CacheLock lock;
+    cache.clear();
+    readCache(dirname, &cache);
+    bool dropped = false;
+    for (int i = cache.size() - 1; i >= 0; --i) {
+      if (!SD.exists(cachePath(dirname, cache[i].name.c_str()))) {
+        cache.erase(cache.begin() + i);
+        dropped = true;
+      }
+    }
+    if (dropped) writeCache(dirname, cache);
+    return true;
+  }
+
+  volatile bool complete;
+};
+
+Manifest manifest;
+
+/** Produces the manifest of the whole card as lines PATH\tSIZE\tMTIME\tMD5, piece by piece (e.g. for a chunked
+ *  response). Only the cache of one directory is held in memory at a time, so this works for any number of files.
+ *  Files changed since the last scan are listed with an empty MD5 (and trigger a new scan). */
+class ManifestLister {
+public:
+  ManifestLister() {
+    File root = SD.open("/");
+    if (root) dirs.push_back(root);
+    cache_loaded = false;
+    line_pos = 0;
+  }
+  /** Fill buf with the next (up to max_len) bytes of the manifest. Returns 0, once complete. */
+  size_t read(uint8_t *buf, size_t max_len) {
+    size_t len = 0;
+    while (len < max_len) {
+      if (line_pos >= line.length() && !nextLine()) break;
+      size_t n = std::min((size_t) (line.length() - line_pos), max_len - len);
+      memcpy(buf + len, line.c_str() + line_pos, n);
+      len += n;
+      line_pos += n;
+    }
+    return len;
+  }
+private:
+  bool nextLine() {
+    line = String();
+    line_pos = 0;
+    while (!dirs.empty()) {
+      File entry = dirs.back().openNextFile();
+      if (!entry) {
+        dirs.pop_back();
+        continue;
+      }
+      String path = entry.name();
+      if (Manifest::isMetaFile(path)) continue;
+      if (entry.isDirectory()) {
+        dirs.push_back(entry);
+        continue;
+      }
+      String dir = Manifest::dirName(path);
+      if (!cache_loaded || dir != cache_dir) {
+        cache.clear();
+        Manifest::CacheLock lock;
+        Manifest::readCache(dir, &cache);
+        cache_dir = dir;
+        cache_loaded = true;
+      }
+      int c = Manifest::findFresh(cache, entry);
+      if (c < 0) manifest.requestScan();
+      line = path + '\t' + String((uint32_t) entry.size()) + '\t' + String((uint32_t) entry.getLastWrite()) + '\t' + (c < 0 ? String() : cache[c].md5) + '\n';
+      return true;
+    }
+    return false;
+  }
+
+  std::vector<File> dirs;  // directories being listed, innermost last
+  String cache_dir;
+  bool cache_loaded;
+  std::vector<ManifestEntry> cache;
+  String line;
+  size_t line_pos;
+};
+
+#endif
@@ -0,0 +1,231 @@
+// kate: space-indent on; indent-width 2; mixedindent off; indent-mode cstyle;
+/*
+ *  The Closed Player - Kid-friendly MP3 player based on RFID tags
+ *  
+ *  See README.md for details and hardware setup.
+ *  
+ *  Copyright (c) 2019 Thomas Friedrichsmeier
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *  
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *  
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SCRUBBER_H
+#define SCRUBBER_H
+
+#include "AudioFileSource.h"
+#include "AudioFileSourceBuffer.h"
+#include "InterruptableOutput.h"
+#include "StatusIndicator.h"
+#include "config.h"
+
+#define SCRUB_DECODER_BUFFER 1536  // Size of the input buffer of AudioGeneratorMP3, i.e. how far it may read ahead of what is being decoded
+
+/** Fast forward / rewind, while playing. Plays short snippets of the track (faded in and out to avoid noise), and skips
+ *  the frames in between, based on the MP3 frame headers. The longer the button is held, the more frames are skipped.
+ *  Jumps are counted from the start of the previous snippet, which is known exactly. Short forward jumps walk the
+ *  frame headers; longer and backward jumps are estimated from the average frame length, and thus only approximate
+ *  for VBR files. The first jump of each hold starts from an estimate of the playback position.
+ *  This does not block: update() merely advances to the next phase, once the previous one is done, while the normal
+ *  generator loop keeps running. */
+class Scrubber {
+public:
+  Scrubber(InterruptableOutput *out, AudioFileSourceBuffer *buff, AudioFileSource *file) {
+    _out = out;
+    _buff = buff;
+    _file = file;
+    phase = Idle;
+    limit_dir = 0;
+    frame_samples = 1152;  // NOTE: The *typical* mp3 frame length is 1152
+    avg_frame_len = 0;
+    last_seek = -1;
+    window_start = 0;
+    window_len = 0;
+  }
+
+  bool isActive() const {
+    return (phase != Idle);
+  }
+
+  /** To be called on every iteration of the main loop, before running the generator.
+   *  @param dir 1 while forward is held, -1 while rewind is held, 0 when neither
+   *  @param held_ms how long the button has been held */
+  void update(int dir, uint32_t held_ms) {
+    if (dir != limit_dir) limit_dir = 0;  // button released (or the other one pressed): signal the limit, again, next time
+    if (_out->isSpecialModeActive()) return;  // current phase is not done, yet
+    if (phase == Idle) {
+      if (!dir) return;
+      avg_frame_len = 0;  // may be a different track than last time
+      last_seek = -1;
+      _out->fadeOut(frame_samples);
+      phase = FadeOut;
+    } else if (phase == FadeOut) {
+      if (!dir) {  // released: back to regular playback at the current position
+        _out->fadeIn(frame_samples);
+        phase = FadeIn;
+        return;
+      }
+      skip(dir, speedFor(held_ms));
+      // Insert a brief silence to avoid noise while the mp3-stream syncs to the new position
+      _out->setSwallow(frame_samples);
+      phase = Swallow;
+    } else if (phase == Swallow) {
+      _out->fadeIn(frame_samples);
+      phase = FadeIn;
+    } else if (phase == FadeIn) {
+      if (!dir) {
+        phase = Idle;
+        return;
+      }
+      _out->setTimeout(frame_samples * SCRUB_SNIPPET_FRAMES);
+      phase = Snippet;
+    } else if (phase == Snippet) {
+      if (!dir) {
+        phase = Idle;
+        return;
+      }
+      _out->fadeOut(frame_samples);
+      phase = FadeOut;
+    }
+  }
+private:
+  static int speedFor(uint32_t held_ms) {
+    if (held_ms < SCRUB_SPEEDUP_MS) return SCRUB_SPEED_1;
+    if (held_ms < 2 * SCRUB_SPEEDUP_MS) return SCRUB_SPEED_2;
+    return SCRUB_SPEED_3;
+  }
+
+  /** Jump by the number of frames needed for the given speed, and sync to the next frame header. */
+  void skip(int dir, int speed) {
+    int32_t size = _file->getSize();
+    // NOTE: The read position of the file is *not* the playback position. It runs ahead by the data buffered in _buff,
+    // and in the decoder. It cannot be behind the last jump, however, unless a new track has been started.
+    int32_t read_pos = _buff->getPos();
+    if (read_pos < last_seek) last_seek = -1;
+
+    // Each cycle plays the snippet, two fades and the swallowed frame. The net movement per cycle is to be speed times that.
+    int32_t played = SCRUB_SNIPPET_FRAMES + 3;
+    int32_t pos;
+    int32_t frames;
+    if (last_seek >= 0) {
+      // The previous snippet started at last_seek, exactly. Count from there.
+      pos = last_seek;
+      frames = dir * speed * played;
+    } else {
+      // First jump in this hold: Estimate the playback position from the read position
+      int32_t ahead = _buff->getFillLevel() + SCRUB_DECODER_BUFFER;
+      pos = findFrame(read_pos > ahead ? read_pos - ahead : 0);
+      frames = (dir > 0) ? (speed - 1) * played : -(speed + 1) * played;
+    }
+    if (frames > 0 && frames <= SCRUB_WALK_FRAMES) {
+      // Follow the headers, frame by frame. Should sync be lost (e.g. in a tag), the rest is estimated, below.
+      while (frames > 0 && pos < size) {
+        int32_t flen = frameAt(pos);
+        if (!flen) break;
+        pos += flen;
+        --frames;
+      }
+    } else {
+      frameAt(pos);  // for the average frame length
+    }
+
+    // NOTE: Assuming all remaining frames to be of average length. Exact for CBR, approximate for VBR.
+    int32_t npos = pos + frames * (avg_frame_len ? avg_frame_len : 418);  // default: 128kbps at 44.1kHz
+    if (npos < 0) {
+      signalLimit(dir);
+      npos = 0;
+    }
+    if (npos >= size) {
+      signalLimit(dir);
+      npos = size - 1;
+    }
+    last_seek = findFrame(npos);
+    _buff->seek(last_seek, SEEK_SET);
+  }
+
+  /** Signal hitting the start / end of the track, only once while the button is held. Otherwise, the cue would be
+   *  restarted on every cycle. */
+  void signalLimit(int dir) {
+    if (limit_dir == dir) return;
+    limit_dir = dir;
+    indicator.setTransientStatus(StatusIndicator::SeekLimit);
+  }
+
+  /** Length of the frame starting at pos, or 0 if there is no valid header at pos. Reads into window, as needed, and
+   *  keeps track of the average frame length. */
+  int32_t frameAt(int32_t pos) {
+    if (pos < window_start || pos + 4 > window_start + window_len) {
+      window_start = pos;
+      _file->seek(pos, SEEK_SET);
+      window_len = _file->read(window, sizeof(window));
+      if (window_len < 4) return 0;
+    }
+    int32_t flen = frameLength(window + (pos - window_start), &frame_samples);
+    if (flen) avg_frame_len = avg_frame_len ? (avg_frame_len * 7 + flen) / 8 : flen;
+    return flen;
+  }
+
+  /** Find the first frame header at or after pos, that is followed by another valid header (to rule out false syncs
+   *  in the audio data). Returns pos, if none was found. Leaves the data read in window. */
+  int32_t findFrame(int32_t pos) {
+    window_start = pos;
+    _file->seek(pos, SEEK_SET);
+    int32_t len = _file->read(window, sizeof(window));
+    window_len = len;
+    for (int32_t i = 0; i + 4 <= len; ++i) {
+      int32_t flen = frameLength(window + i);
+      if (!flen) continue;
+      if (i + flen + 4 > len || frameLength(window + i + flen)) return pos + i;  // can't check beyond the window, accept
+    }
+    return pos;
+  }
+
+  /** Parse an MPEG 1/2/2.5 layer III frame header. Returns the frame length in bytes, or 0, if not a valid header. */
+  static int32_t frameLength(const uint8_t *h, uint16_t *samples = 0) {
+    static const uint16_t bitrates_v1[] = { 0, 32, 40, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320 };
+    static const uint16_t bitrates_v2[] = { 0, 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160 };
+    static const uint16_t rates[] = { 44100, 48000, 32000 };
+
+    if (h[0] != 0xFF || (h[1] & 0xE0) != 0xE0) return 0;
+    int version = (h[1] >> 3) & 3;  // 3: MPEG 1, 2: MPEG 2, 0: MPEG 2.5
+    int layer = (h[1] >> 1) & 3;    // 1: layer III
+    int bitrate_index = h[2] >> 4;
+    int rate_index = (h[2] >> 2) & 3;
+    if (version == 1 || layer != 1 || bitrate_index == 0 || bitrate_index == 15 || rate_index == 3) return 0;
+
+    uint32_t bitrate = (version == 3 ? bitrates_v1[bitrate_index] : bitrates_v2[bitrate_index]) * 1000;
+    uint32_t rate = rates[rate_index] >> (version == 3 ? 0 : (version == 2 ? 1 : 2));
+    uint16_t spf = (version == 3) ? 1152 : 576;
+    if (samples) *samples = spf;
+    return (spf / 8) * bitrate / rate + ((h[2] >> 1) & 1);
+  }
+
+  InterruptableOutput *_out;
+  AudioFileSourceBuffer *_buff;
+  AudioFileSource *_file;
+  enum {
+    Idle,
+    FadeOut,
+    Swallow,
+    FadeIn,
+    Snippet
+  } phase;
+  int limit_dir;  // direction, in which the limit has been signalled, while the button is still held
+  uint16_t frame_samples;
+  int32_t avg_frame_len;  // running average over the frames seen during this hold, 0 if none, yet
+  int32_t last_seek;      // file position of the last jump (i.e. start of the current snippet), -1 if none during this hold
+  int32_t window_start;
+  int32_t window_len;
+  uint8_t window[2048];
+};
+
+#endif
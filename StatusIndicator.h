@@ -32,6 +32,7 @@ public:
     transient_bits = 0;
     permanent_bits = 0;
     transient_timeout = 0;
+    status_hook = 0;
     pinMode(LED_BLUE_PIN, OUTPUT);
     pinMode(LED_GREEN_PIN, OUTPUT);
     pinMode(LED_RED_PIN, OUTPUT);
@@ -44,11 +45,15 @@ public:
     BatteryLow   = 1 << 2,
     Playing      = 1 << 3,
     AtFileEOF    = 1 << 4,
-    Error        = 1 << 5
+    Error        = 1 << 5,
+    PlaylistEnd  = 1 << 6,  // Shown like AtFileEOF, but there is no further track to play
+    SeekLimit    = 1 << 7,  // Shown like AtFileEOF, but reached while seeking
+    TagRecognized = 1 << 8  // No visual indication, but may trigger an audio cue
   };
+  typedef void (*StatusHook)(StatusBits which);
   bool isIdle() {
     uint16_t bits = permanent_bits | transient_bits;
-    if (bits & (Playing | AtFileEOF | WIFIActivity | WIFIEnabled)) return false;
+    if (bits & (Playing | AtFileEOF | PlaylistEnd | SeekLimit | WIFIActivity | WIFIEnabled)) return false;
     return true;
   }
   void update() {
@@ -72,10 +77,10 @@ public:
     if (bits & Error) {
       digitalWrite(LED_RED_PIN, (now / 250) % 2);
     } else {
-      digitalWrite(LED_RED_PIN, bits & (BatteryLow | AtFileEOF));
+      digitalWrite(LED_RED_PIN, bits & (BatteryLow | AtFileEOF | PlaylistEnd | SeekLimit));
     }
 
-    uint16_t error_bits = bits & (Error | AtFileEOF);
+    uint16_t error_bits = bits & (Error | AtFileEOF | PlaylistEnd | SeekLimit);
     if ((bits & Playing) && !error_bits) {
       ledcWrite(CHANNEL_LED_GREEN, 255);
     } else if (isIdle()) {
@@ -88,13 +93,24 @@ public:
   void setTransientStatus(StatusBits which) {
     transient_bits |= which;
     transient_timeout = millis() + 500;
+    if (status_hook) status_hook(which);
   }
   // Set a status bit that will stick, until cleared, explicitly
   void setPermanentStatus(StatusBits which, bool on=true) {
-    if (on) permanent_bits |= which;
-    else permanent_bits -= (permanent_bits & which);
+    if (on) {
+      if (status_hook && !(permanent_bits & which)) status_hook(which);
+      permanent_bits |= which;
+    } else {
+      permanent_bits -= (permanent_bits & which);
+    }
+  }
+  // Register a function to be called whenever a status bit gets set (e.g. to play a matching audio cue).
+  // For permanent status bits, this is called only when the bit was not already set.
+  void setStatusHook(StatusHook hook) {
+    status_hook = hook;
   }
 private:
+  StatusHook status_hook;
   uint16_t transient_bits;
   uint16_t permanent_bits;
   uint32_t transient_timeout;
@@ -26,10 +26,13 @@ void startWebInterface(bool access_point, const char* sess_id=0, const char *ses
 void stopWebInterface();
 char bitsToHex(byte bits);
 
+#include <memory>
 #include <AsyncTCP.h>
 #include <ESPAsyncWebServer.h>
 #include <WiFi.h>
 #include "StatusIndicator.h"
+#include "LoudnessAnalyzer.h"
+#include "Manifest.h"
 
 AsyncWebServer *server = 0;
 bool isWebInterfaceActive() { return server; };
@@ -76,6 +79,242 @@ void rmRf(const String &path) {
   }
 }
 
+/** Create directory, including any missing parent directories */
+void mkdirs(const String &path) {
+  for (int pos = path.indexOf('/', 1); pos > 0; pos = path.indexOf('/', pos + 1)) {
+    SD.mkdir(path.substring(0, pos));
+  }
+  if (path.length() > 1) SD.mkdir(path);
+}
+
+#define SYNC_MAX_LINE 512   // Maximum length of a line in the desired manifest posted to /sync
+#define SYNC_MAX_FILES 32   // Maximum number of files to upload (and to remove) per round of /sync, to keep memory usage bounded
+
+/** State of an ongoing sync. See /sync, below. All paths are absolute. Nothing in here grows with the number of files on
+ *  the card, except for wanted_dirs (four bytes per directory). */
+struct SyncState {
+  SyncState() { pending = 0; more = false; deleting = false; in_wanted_dir = false; }
+  std::vector<ManifestEntry> needed;    // files to be uploaded in this round
+  std::vector<String> obsolete;         // files to be removed on commit
+  std::vector<ManifestEntry> received;  // files uploaded to the staging dir, so far
+  String put_errors;                    // files that could not be staged in the current /sync/put request
+  bool more;                            // whether another round will be needed
+  // The following are only used while the desired manifest is being received
+  String partial_line;
+  String error;
+  Manifest::DirCache dir_cache;
+  ManifestEntry tags;                   // tags.txt, if it needs to be uploaded
+  uint32_t pending;                     // number of files to be uploaded (other than tags.txt), including those beyond needed
+  bool deleting;
+  bool in_wanted_dir;
+  String wanted_dir;                    // directory of the current group of lines
+  std::vector<String> wanted_names;     // names of the files wanted in wanted_dir
+  std::vector<uint32_t> wanted_dirs;    // hashes of all directories with wanted files (see pathHash())
+} sync_state;
+
+/** 32 bit FNV-1a hash of a path. Used to tell which directories are wanted during a sync. In the unlikely case of a
+ *  collision, obsolete files are simply not removed. */
+uint32_t pathHash(const String &path) {
+  uint32_t hash = 2166136261u;
+  for (unsigned int i = 0; i < path.length(); ++i) {
+    hash ^= (uint8_t) path.charAt(i);
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+/** Never removed by a sync, even if not in the desired manifest */
+bool isKeptOnSync(const String &path) {
+  return (Manifest::isMetaFile(path) || path == "/tags.txt");
+}
+
+void addObsoleteFile(const String &path) {
+  if (sync_state.obsolete.size() < SYNC_MAX_FILES) sync_state.obsolete.push_back(path);
+  else sync_state.more = true;
+}
+
+/** All wanted files of the current directory have been listed: Any other files in that directory are obsolete. */
+void finishWantedDir() {
+  if (!sync_state.in_wanted_dir) return;
+  File dir = SD.open(sync_state.wanted_dir.length() ? sync_state.wanted_dir : String("/"));
+  File entry = dir ? dir.openNextFile() : File();
+  while (entry && !sync_state.more) {
+    String path = entry.name();
+    if (!entry.isDirectory() && !isKeptOnSync(path)) {
+      const std::vector<String> &names = sync_state.wanted_names;
+      if (std::find(names.begin(), names.end(), Manifest::baseName(path)) == names.end()) addObsoleteFile(path);
+    }
+    entry = dir.openNextFile();
+  }
+  sync_state.wanted_names.clear();
+  sync_state.in_wanted_dir = false;
+}
+
+/** Collect files below dir, which are in none of the (sorted) wanted_dirs. Files in wanted dirs have been handled by
+ *  finishWantedDir(), already. */
+void findObsoleteFiles(File dir) {
+  const std::vector<uint32_t> &wanted = sync_state.wanted_dirs;
+  File entry = dir.openNextFile();
+  while (entry && !sync_state.more) {
+    String path = entry.name();
+    if (isKeptOnSync(path)) {
+      // never remove those
+    } else if (entry.isDirectory()) {
+      findObsoleteFiles(entry);
+    } else if (!std::binary_search(wanted.begin(), wanted.end(), pathHash(Manifest::dirName(path)))) {
+      addObsoleteFile(path);
+    }
+    entry = dir.openNextFile();
+  }
+}
+
+/** Start a new sync, discarding anything staged before. */
+void startSync(bool deleting) {
+  rmRf(SYNC_STAGING_DIR);
+  sync_state = SyncState();
+  sync_state.deleting = deleting;
+}
+
+/** Handle one line (PATH\tSIZE\tMD5) of the desired manifest posted to /sync. Lines are handled as they arrive, and only
+ *  the first SYNC_MAX_FILES needed files are kept, so memory usage does not depend on the size of the manifest. */
+void syncWantedLine(String line) {
+  if (line.endsWith("\r")) line.remove(line.length() - 1);
+  int tab1 = line.indexOf('\t');
+  int tab2 = line.indexOf('\t', tab1 + 1);
+  if (tab1 < 1 || tab2 < 0) return;
+  String path = line.substring(0, tab1);
+  if (!path.startsWith("/")) path = "/" + path;
+  if (Manifest::isMetaFile(path)) return;
+  String md5 = line.substring(tab2 + 1);
+
+  if (sync_state.deleting) {
+    String dir = Manifest::dirName(path);
+    if (!sync_state.in_wanted_dir || dir != sync_state.wanted_dir) {
+      finishWantedDir();
+      uint32_t hash = pathHash(dir);
+      std::vector<uint32_t> &dirs = sync_state.wanted_dirs;
+      if (std::find(dirs.begin(), dirs.end(), hash) != dirs.end()) {
+        sync_state.error = "Files of each directory must be listed consecutively, for deleting";
+      }
+      dirs.push_back(hash);
+      sync_state.wanted_dir = dir;
+      sync_state.in_wanted_dir = true;
+    }
+    sync_state.wanted_names.push_back(Manifest::baseName(path));
+  }
+
+  if (Manifest::isUpToDate(path, md5, &sync_state.dir_cache)) return;
+  ManifestEntry e = { path, (uint32_t) line.substring(tab1 + 1, tab2).toInt(), 0, md5 };
+  if (path == "/tags.txt") {
+    sync_state.tags = e;
+  } else {
+    ++sync_state.pending;
+    if (sync_state.needed.size() < SYNC_MAX_FILES) sync_state.needed.push_back(e);
+  }
+}
+
+/** The desired manifest is complete: Decide, what to do in this round. */
+void finishSyncRequest() {
+  if (sync_state.pending > sync_state.needed.size()) sync_state.more = true;
+  if (sync_state.pending) {
+    // Files are removed, and tags.txt is replaced only once all new content is in place, i.e. in the last round(s)
+    sync_state.obsolete.clear();
+  } else {
+    if (sync_state.tags.name.length()) sync_state.needed.push_back(sync_state.tags);
+    if (sync_state.deleting) {
+      finishWantedDir();
+      std::sort(sync_state.wanted_dirs.begin(), sync_state.wanted_dirs.end());
+      findObsoleteFiles(SD.open("/"));
+    }
+  }
+
+  // Free what is no longer needed
+  sync_state.partial_line = String();
+  sync_state.dir_cache = Manifest::DirCache();
+  sync_state.tags = ManifestEntry();
+  sync_state.wanted_dir = String();
+  sync_state.wanted_names = std::vector<String>();
+  sync_state.wanted_dirs = std::vector<uint32_t>();
+}
+
+/** Move all staged files into place, and remove obsolete files. Indices are updated at the end, and tags.txt is
+ *  replaced last of all, so it never refers to content that is not there, yet.
+ *  Returns the paths of the files that could not be moved (one per line), or an empty string on success. In case of
+ *  failure, obsolete files are not removed, tags.txt is not replaced, and the failed files are kept in the staging dir,
+ *  so the commit can be retried. */
+String commitSync() {
+  const String tags = "/tags.txt";
+  std::vector<ManifestEntry> moved;
+  std::vector<ManifestEntry> not_moved;
+  String failed;
+  String tags_md5;
+  for (unsigned int i = 0; i < sync_state.received.size(); ++i) {
+    const ManifestEntry &e = sync_state.received[i];
+    if (e.name == tags) {
+      tags_md5 = e.md5;
+      not_moved.push_back(e);
+      continue;
+    }
+    mkdirs(Manifest::dirName(e.name));
+    SD.remove(e.name);
+    if (SD.rename(SYNC_STAGING_DIR + e.name, e.name)) {
+      moved.push_back(e);
+    } else {
+      Serial.print("Failed to move into place: ");
+      Serial.println(e.name);
+      Manifest::remove(e.name);  // the old version is gone, already
+      not_moved.push_back(e);
+      failed += e.name + "\n";
+    }
+  }
+  Manifest::update(moved);
+  loudness.requestScan();
+
+  if (failed.length()) {
+    // Forget about what was moved, successfully. Everything else stays pending.
+    std::vector<ManifestEntry> still_needed;
+    for (unsigned int i = 0; i < sync_state.needed.size(); ++i) {
+      bool done = false;
+      for (unsigned int j = 0; j < moved.size(); ++j) {
+        if (moved[j].name == sync_state.needed[i].name) done = true;
+      }
+      if (!done) still_needed.push_back(sync_state.needed[i]);
+    }
+    sync_state.needed = still_needed;
+    sync_state.received = not_moved;
+    return failed;
+  }
+
+  for (unsigned int i = 0; i < sync_state.obsolete.size(); ++i) {
+    rmRf(sync_state.obsolete[i]);
+    Manifest::remove(sync_state.obsolete[i]);
+  }
+
+  if (tags_md5.length()) {
+    // Never delete the old tags.txt before the new one is in place: Move it out of the way, first, and only remove it,
+    // once the new one has arrived. Should we lose power, in between, the backup is restored at boot.
+    SD.remove(TAGS_BACKUP);
+    bool ok = !SD.exists(tags) || SD.rename(tags, TAGS_BACKUP);
+    if (ok && !SD.rename(SYNC_STAGING_DIR + tags, tags)) {
+      SD.rename(TAGS_BACKUP, tags);
+      ok = false;
+    }
+    if (!ok) {
+      // Everything else is done. Keep only tags.txt staged, so the commit can be retried.
+      sync_state.obsolete.clear();
+      sync_state.received = std::vector<ManifestEntry>(1, ManifestEntry { tags, 0, 0, tags_md5 });
+      sync_state.needed = sync_state.received;
+      return tags + "\n";
+    }
+    SD.remove(TAGS_BACKUP);
+    Manifest::update(std::vector<ManifestEntry>(1, ManifestEntry { tags, 0, 0, tags_md5 }));
+  }
+
+  rmRf(SYNC_STAGING_DIR);
+  sync_state = SyncState();
+  return String();
+}
+
 void startWebInterface(bool access_point, const char* sess_id, const char *sess_pass) {
   if (server) return;
   Serial.println("Starting WIFI");
@@ -157,6 +396,7 @@ void startWebInterface(bool access_point, const char* sess_id, const char *sess_
     if (request->hasParam("path")) path = request->getParam("path")->value();
     if (path.length() < 1) return;
     rmRf(path);
+    Manifest::remove(path);
     request->send(200, "text/html", backPage("<h1>Directory deleted</h1>"));
   });
   server->on("/put", HTTP_POST, [] (AsyncWebServerRequest *request) {
@@ -164,6 +404,9 @@ void startWebInterface(bool access_point, const char* sess_id, const char *sess_
   }, [] (AsyncWebServerRequest *request, String filename, size_t index, uint8_t *data, size_t len, bool final) {
     indicator.setTransientStatus(StatusIndicator::WIFIActivity);
     static File out;
+    static MD5Builder md5;
+    static String path;  // NOTE: filename is only resolved to the full path on the first chunk, but needed on the last
+    background.notifyActivity();  // don't analyze / hash the file, while it is still incomplete
     if(!index) {
       if (out) out.close();
       String dir = "/";
@@ -174,22 +417,173 @@ void startWebInterface(bool access_point, const char* sess_id, const char *sess_
       if (slashpos > 0) {
         dir += filename.substring(0, slashpos);
         SD.mkdir(dir);
-        filename = dir + filename.substring(slashpos); // includes the slash itself
+        path = dir + filename.substring(slashpos); // includes the slash itself
       } else {
-        filename = dir + filename;
+        path = dir + filename;
       }
-      if (SD.exists(filename)) SD.remove(filename);
-      out = SD.open(filename, FILE_WRITE);
+      if (SD.exists(path)) SD.remove(path);
+      out = SD.open(path, FILE_WRITE);
+      md5.begin();
     }
 
-    if (len) out.write(data, len);
+    if (len) {
+      out.write(data, len);
+      md5.add(data, len);
+    }
 
     if(final){
       out.close();
+      md5.calculate();
+      Manifest::update(std::vector<ManifestEntry>(1, ManifestEntry { path, 0, 0, md5.toString() }));
+      loudness.requestScan();
       String dir;
       request->send(200, "text/html", backPage("<h1>Upload complete</h1>"));
     }
   });
+
+  // Sync API, for bulk updates:
+  // 1. GET /manifest lists PATH\tSIZE\tMTIME\tMD5 of all files. Returns 503, while hashes are still being computed.
+  //    Informational, only; not needed for the steps below.
+  // 2. POST /sync with the desired manifest (text/plain, lines of PATH\tSIZE\tMD5, preferrably sorted by path) as body.
+  //    Returns a list of files to upload ("+\tPATH"). With "?delete=1", also files not in the desired manifest will be
+  //    removed ("-\tPATH"); the files of each directory must then be listed consecutively. At most SYNC_MAX_FILES of
+  //    each are listed per round. If more remain, the list ends with "*\tmore", and the whole sequence is to be
+  //    repeated, after the commit. Files are removed, and tags.txt is replaced only in the last round(s).
+  // 3. POST /sync/put (multipart; file name is the full path) the needed files, all in one request, preferrably.
+  //    Returns 500 and a list of files that could not be written (or were not requested), if any.
+  // 4. POST /sync/commit to move everything into place. Returns 409 and a list of files still missing, if incomplete,
+  //    or 500 and a list of files that could not be moved into place (the commit may be retried).
+  // NOTE: More specific URIs must be registered first, as "/sync" also matches "/sync/..."
+  server->on("/manifest", HTTP_GET, [] (AsyncWebServerRequest *request) {
+    indicator.setTransientStatus(StatusIndicator::WIFIActivity);
+    if (!manifest.isComplete()) {
+      request->send(503, "text/plain", "Manifest is being updated, try again later");
+      return;
+    }
+    // Sent in chunks, while walking the card, as the listing of a large card would not fit into RAM
+    std::shared_ptr<ManifestLister> lister(new ManifestLister());
+    request->send(request->beginChunkedResponse("text/plain", [lister] (uint8_t *buffer, size_t max_len, size_t index) -> size_t {
+      return lister->read(buffer, max_len);
+    }));
+  });
+  server->on("/sync/put", HTTP_POST, [] (AsyncWebServerRequest *request) {
+    if (sync_state.put_errors.length()) {
+      request->send(500, "text/plain", sync_state.put_errors);
+      sync_state.put_errors = String();
+      return;
+    }
+    request->send(200, "text/plain", "OK");
+  }, [] (AsyncWebServerRequest *request, String filename, size_t index, uint8_t *data, size_t len, bool final) {
+    indicator.setTransientStatus(StatusIndicator::WIFIActivity);
+    static File out;
+    static MD5Builder md5;
+    static String path;
+    static bool ok;
+    background.notifyActivity();
+    if (!index) {
+      if (out) out.close();
+      path = filename.startsWith("/") ? filename : ("/" + filename);
+      // Only files requested in this round are accepted, so received cannot grow beyond needed
+      ok = false;
+      for (unsigned int i = 0; i < sync_state.needed.size(); ++i) {
+        if (sync_state.needed[i].name == path) ok = true;
+      }
+      if (ok) {
+        String staged = SYNC_STAGING_DIR + path;
+        mkdirs(Manifest::dirName(staged));
+        SD.remove(staged);
+        out = SD.open(staged, FILE_WRITE);
+        ok = out;
+      }
+      md5.begin();
+    }
+
+    if (len && ok) {
+      if (out.write(data, len) != len) ok = false;
+      md5.add(data, len);
+    }
+
+    if (final) {
+      if (out) out.close();
+      // Double check that everything has arrived on the card, as only then the md5 is the md5 of the staged file
+      File check = SD.open(SYNC_STAGING_DIR + path);
+      if (!check || check.size() != index + len) ok = false;
+      check.close();
+      if (ok) {
+        md5.calculate();
+        ManifestEntry e = { path, (uint32_t) (index + len), 0, md5.toString() };
+        bool replaced = false;
+        for (unsigned int i = 0; i < sync_state.received.size(); ++i) {
+          if (sync_state.received[i].name == path) {  // uploaded again: last upload wins
+            sync_state.received[i] = e;
+            replaced = true;
+          }
+        }
+        if (!replaced) sync_state.received.push_back(e);
+      } else {
+        Serial.print("Failed to stage: ");
+        Serial.println(path);
+        SD.remove(SYNC_STAGING_DIR + path);
+        if (sync_state.put_errors.length() < 1024) sync_state.put_errors += path + "\n";
+      }
+    }
+  });
+  server->on("/sync/commit", HTTP_POST, [] (AsyncWebServerRequest *request) {
+    indicator.setTransientStatus(StatusIndicator::WIFIActivity);
+    String missing;
+    for (unsigned int i = 0; i < sync_state.needed.size(); ++i) {
+      const ManifestEntry &n = sync_state.needed[i];
+      bool ok = false;
+      for (unsigned int j = 0; j < sync_state.received.size(); ++j) {
+        if (sync_state.received[j].name == n.name) ok = (sync_state.received[j].md5 == n.md5);
+      }
+      if (!ok) missing += n.name + "\n";
+    }
+    if (missing.length()) {
+      request->send(409, "text/plain", missing);
+      return;
+    }
+    String failed = commitSync();
+    if (failed.length()) {
+      request->send(500, "text/plain", failed);
+      return;
+    }
+    request->send(200, "text/plain", "OK");
+  });
+  server->on("/sync", HTTP_POST, [] (AsyncWebServerRequest *request) {
+    indicator.setTransientStatus(StatusIndicator::WIFIActivity);
+    if (!request->contentLength()) startSync(request->hasParam("delete"));  // body handler was never called
+    if (sync_state.partial_line.length()) syncWantedLine(sync_state.partial_line);  // last line without newline
+    if (sync_state.error.length()) {
+      String error = sync_state.error;
+      sync_state = SyncState();
+      request->send(400, "text/plain", error);
+      return;
+    }
+    finishSyncRequest();
+
+    // NOTE: The reply is bounded by SYNC_MAX_FILES, so it is fine to keep it in RAM
+    AsyncResponseStream *response = request->beginResponseStream("text/plain");
+    for (unsigned int i = 0; i < sync_state.needed.size(); ++i) response->printf("+\t%s\n", sync_state.needed[i].name.c_str());
+    for (unsigned int i = 0; i < sync_state.obsolete.size(); ++i) response->printf("-\t%s\n", sync_state.obsolete[i].c_str());
+    if (sync_state.more) response->print("*\tmore\n");
+    request->send(response);
+  }, NULL, [] (AsyncWebServerRequest *request, uint8_t *data, size_t len, size_t index, size_t total) {
+    // Lines are handled as they arrive, so the work per call is bounded by the size of the chunk
+    background.notifyActivity();
+    if (!index) startSync(request->hasParam("delete"));
+    for (size_t i = 0; i < len; ++i) {
+      char c = data[i];
+      if (c == '\n') {
+        syncWantedLine(sync_state.partial_line);
+        sync_state.partial_line = String();
+      } else if (sync_state.partial_line.length() < SYNC_MAX_LINE) {
+        sync_state.partial_line += c;
+      } else {
+        sync_state.error = "Line too long";
+      }
+    }
+  });
   server->begin();
 
   indicator.setPermanentStatus(StatusIndicator::WIFIEnabled);
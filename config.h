@@ -65,5 +65,28 @@
 
 #define IDLE_SHUTDOWN_TIMEOUT 120  // Cut the power after this many seconds of being idle (no card present, or finished playing)
 
+// Files uploaded via tools/sync.py are kept, here, until the sync is complete. Ignored by all background processing.
+#define SYNC_STAGING_DIR     "/sync.tmp"
+
+// Audio cues (feedback sounds). Place short MP3 files in this directory on the SD card. See README.md for the file names.
+#define CUE_DIR              "/cues"
+#define CUE_TOTAL_SAMPLES    8000  // Cues are kept in RAM (2 bytes per sample), and all cues together are cut off after this many (mono) samples. Encode them at a low sample rate (e.g. 8kHz) to make them fit.
+#define CUE_ATTACK_MS          10  // Fade-in time of cues, to avoid clicks
+#define CUE_RELEASE_MS         40  // Fade-out time of cues
+#define CUE_DUCK_DEPTH      16384  // How much to lower the track volume while a cue is playing. 0: not at all, 32767: mute the track. 16384 is about half the volume.
+
+// Loudness normalization. Tracks are analyzed in the background, while the player is not playing.
+#define NORMALIZE_TARGET_DB    -18  // Target loudness (mean power in dBFS). Tracks are made louder or quieter to match this.
+#define NORMALIZE_MAX_BOOST_DB   9  // Never make a track louder than this (in dB). Also, tracks are never boosted beyond their peak.
+#define NORMALIZE_MAX_CUT_DB    12  // Never make a track quieter than this (in dB)
+
+// Fast forward / rewind. Short snippets are played, skipping the frames in between. The longer a button is held, the faster.
+#define SCRUB_SNIPPET_FRAMES     4  // Length of each snippet in mp3 frames (typically 26ms, each)
+#define SCRUB_SPEEDUP_MS      3000  // Switch to the next speed after holding the button for this long (and again after twice as long)
+#define SCRUB_SPEED_1            2
+#define SCRUB_SPEED_2            8
+#define SCRUB_SPEED_3           32
+#define SCRUB_WALK_FRAMES       64  // Forward skips of up to this many frames follow the frame headers (exact, but slower). Longer skips are estimated from the average frame length.
+
 #endif
 
@@ -0,0 +1,143 @@
+#!/usr/bin/env python3
+#
+#  The Closed Player - Kid-friendly MP3 player based on RFID tags
+#
+#  Sync a local directory to the player's SD card, uploading only files that are missing or changed.
+#  See README.md for details.
+#
+#  Copyright (c) 2019 Thomas Friedrichsmeier
+#  This program is free software: you can redistribute it and/or modify
+#  it under the terms of the GNU General Public License as published by
+#  the Free Software Foundation, either version 3 of the License, or
+#  (at your option) any later version.
+#
+#  This program is distributed in the hope that it will be useful,
+#  but WITHOUT ANY WARRANTY; without even the implied warranty of
+#  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#  GNU General Public License for more details.
+#
+#  You should have received a copy of the GNU General Public License
+#  along with this program. If not, see <http://www.gnu.org/licenses/>.
+
+import argparse
+import hashlib
+import http.client
+import os
+import sys
+import uuid
+
+# Files managed by the player itself. Never synced.
+META_FILES = ("manifest.txt", "manifest.tmp", "loudness.txt", "loudness.tmp")
+
+
+def local_manifest(root):
+    entries = []
+    for dirpath, dirnames, filenames in os.walk(root):
+        dirnames.sort()
+        for name in sorted(filenames):
+            if name in META_FILES:
+                continue
+            full = os.path.join(dirpath, name)
+            md5 = hashlib.md5()
+            with open(full, "rb") as f:
+                for chunk in iter(lambda: f.read(65536), b""):
+                    md5.update(chunk)
+            path = "/" + os.path.relpath(full, root).replace(os.sep, "/")
+            entries.append((path, os.path.getsize(full), md5.hexdigest(), full))
+    return entries
+
+
+def request(conn, method, url, body=None, headers={}):
+    conn.request(method, url, body, headers)
+    response = conn.getresponse()
+    return response.status, response.read().decode("utf-8", "replace")
+
+
+def upload(conn, files):
+    """Upload all files in a single multipart POST, streaming them from disk."""
+    boundary = uuid.uuid4().hex
+    parts = []
+    length = 0
+    for path, full in files:
+        head = ('--%s\r\nContent-Disposition: form-data; name="file"; filename="%s"\r\n'
+                'Content-Type: application/octet-stream\r\n\r\n' % (boundary, path)).encode("utf-8")
+        parts.append((head, full))
+        length += len(head) + os.path.getsize(full) + 2
+    tail = ("--%s--\r\n" % boundary).encode("utf-8")
+    length += len(tail)
+
+    conn.putrequest("POST", "/sync/put")
+    conn.putheader("Content-Type", "multipart/form-data; boundary=" + boundary)
+    conn.putheader("Content-Length", str(length))
+    conn.endheaders()
+    for head, full in parts:
+        conn.send(head)
+        with open(full, "rb") as f:
+            for chunk in iter(lambda: f.read(8192), b""):
+                conn.send(chunk)
+        conn.send(b"\r\n")
+    conn.send(tail)
+    response = conn.getresponse()
+    return response.status, response.read().decode("utf-8", "replace")
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Sync a local directory to a ClosedPlayer")
+    parser.add_argument("directory", help="Local directory, mirroring the SD card layout")
+    parser.add_argument("--host", default="192.168.4.1", help="Player address (default: %(default)s)")
+    parser.add_argument("--port", type=int, default=80)
+    parser.add_argument("--delete", action="store_true", help="Remove files from the player, which are not present, locally")
+    parser.add_argument("--dry-run", action="store_true", help="Only show what would be done")
+    args = parser.parse_args()
+
+    entries = local_manifest(args.directory)
+    by_path = dict((e[0], e[3]) for e in entries)
+    conn = http.client.HTTPConnection(args.host, args.port, timeout=120)
+
+    # NOTE: Files of each directory are listed consecutively, as required for --delete
+    body = "".join("%s\t%d\t%s\n" % (path, size, md5) for path, size, md5, full in entries).encode("utf-8")
+
+    # The player lists a limited number of files per round, so repeat until there is nothing left to do
+    uploaded = 0
+    previous = None
+    while True:
+        status, text = request(conn, "POST", "/sync" + ("?delete=1" if args.delete else ""), body,
+                               {"Content-Type": "text/plain"})
+        if status != 200:
+            sys.exit("sync failed (%d): %s" % (status, text))
+
+        needed = []
+        changes = []
+        more = False
+        for line in text.splitlines():
+            op, _, path = line.partition("\t")
+            if op == "*":
+                more = True
+                continue
+            print(op, path)
+            changes.append(line)
+            if op == "+":
+                needed.append((path, by_path[path]))
+        if args.dry_run:
+            if more:
+                print("(more changes, and possibly removals, to follow; not shown in a dry run)")
+            return
+        if not changes:
+            break
+        if changes == previous:
+            sys.exit("sync is not making progress")
+        previous = changes
+
+        if needed:
+            status, text = upload(conn, needed)
+            if status != 200:
+                sys.exit("upload failed (%d): %s" % (status, text))
+        status, text = request(conn, "POST", "/sync/commit")
+        if status != 200:
+            sys.exit("commit failed (%d): %s" % (status, text))
+        uploaded += len(needed)
+    print("Sync complete: %d files uploaded" % uploaded)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,196 @@
+#!/usr/bin/env python3
+#
+#  The Closed Player - Kid-friendly MP3 player based on RFID tags
+#
+#  Stand-in for the player's sync API (see WebInterface.h), serving a local directory in place of the SD card.
+#  Meant for testing sync.py without a player at hand:
+#
+#    ./sync_standin.py /tmp/card --port 8080 &
+#    ./sync.py /path/to/music --host 127.0.0.1 --port 8080 [--delete]
+#
+#  Uploads are checked strictly: A multipart body that does not match its Content-Length exactly is rejected.
+#  Like the player, at most --page files are listed per round of /sync (see SYNC_MAX_FILES in WebInterface.h). Use a
+#  small value to test paging.
+#
+#  Copyright (c) 2019 Thomas Friedrichsmeier
+#  This program is free software: you can redistribute it and/or modify
+#  it under the terms of the GNU General Public License as published by
+#  the Free Software Foundation, either version 3 of the License, or
+#  (at your option) any later version.
+#
+#  This program is distributed in the hope that it will be useful,
+#  but WITHOUT ANY WARRANTY; without even the implied warranty of
+#  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#  GNU General Public License for more details.
+#
+#  You should have received a copy of the GNU General Public License
+#  along with this program. If not, see <http://www.gnu.org/licenses/>.
+
+import argparse
+import hashlib
+import http.server
+import os
+import re
+import shutil
+import sys
+import urllib.parse
+
+META_FILES = ("manifest.txt", "manifest.tmp", "loudness.txt", "loudness.tmp")
+META_PATHS = ("/resume.txt", "/tags.bak", "/tags.txt")  # tags.txt is never deleted, but may be replaced
+STAGING_DIR = "/sync.tmp"
+
+
+class State:
+    root = None
+    page = 32
+    needed = {}    # path -> md5
+    obsolete = []
+    received = {}  # path -> md5
+
+
+def local_path(path):
+    return os.path.join(State.root, path.lstrip("/"))
+
+
+def md5_of(full):
+    md5 = hashlib.md5()
+    with open(full, "rb") as f:
+        for chunk in iter(lambda: f.read(65536), b""):
+            md5.update(chunk)
+    return md5.hexdigest()
+
+
+def card_files():
+    """All non-meta files on the "card", as (path, full path)."""
+    for dirpath, dirnames, filenames in os.walk(State.root):
+        dirnames.sort()
+        for name in sorted(filenames):
+            full = os.path.join(dirpath, name)
+            path = "/" + os.path.relpath(full, State.root).replace(os.sep, "/")
+            if name in META_FILES or path.startswith(STAGING_DIR + "/") or path in ("/resume.txt", "/tags.bak"):
+                continue
+            yield path, full
+
+
+class Handler(http.server.BaseHTTPRequestHandler):
+    protocol_version = "HTTP/1.1"  # keep-alive, like sync.py expects
+
+    def reply(self, status, text):
+        body = text.encode("utf-8")
+        self.send_response(status)
+        self.send_header("Content-Type", "text/plain")
+        self.send_header("Content-Length", str(len(body)))
+        self.end_headers()
+        self.wfile.write(body)
+
+    def read_body(self):
+        return self.rfile.read(int(self.headers.get("Content-Length", 0)))
+
+    def do_GET(self):
+        if self.path != "/manifest":
+            return self.reply(404, "Not found")
+        self.reply(200, "".join("%s\t%d\t0\t%s\n" % (p, os.path.getsize(f), md5_of(f)) for p, f in card_files()))
+
+    def do_POST(self):
+        url = urllib.parse.urlparse(self.path)
+        if url.path == "/sync":
+            self.sync(self.read_body().decode("utf-8"), "delete" in urllib.parse.parse_qs(url.query))
+        elif url.path == "/sync/put":
+            self.put(self.read_body())
+        elif url.path == "/sync/commit":
+            self.read_body()
+            self.commit()
+        else:
+            self.read_body()
+            self.reply(404, "Not found")
+
+    def sync(self, body, delete):
+        shutil.rmtree(local_path(STAGING_DIR), ignore_errors=True)
+        State.needed, State.obsolete, State.received = {}, [], {}
+        wanted = set()
+        dirs = []
+        needed = []
+        tags = None
+        for line in body.splitlines():
+            fields = line.split("\t")
+            if len(fields) != 3:
+                continue
+            path = fields[0] if fields[0].startswith("/") else "/" + fields[0]
+            wanted.add(path)
+            directory = path.rpartition("/")[0]
+            if delete and (not dirs or dirs[-1] != directory):
+                if directory in dirs:
+                    return self.reply(400, "Files of each directory must be listed consecutively, for deleting")
+                dirs.append(directory)
+            full = local_path(path)
+            if not os.path.isfile(full) or md5_of(full) != fields[2]:
+                if path == "/tags.txt":
+                    tags = (path, fields[2])
+                else:
+                    needed.append((path, fields[2]))
+        more = len(needed) > State.page
+        State.needed = dict(needed[:State.page])
+        if not needed:
+            # Files are removed, and tags.txt is replaced only once all new content is in place
+            if tags:
+                State.needed[tags[0]] = tags[1]
+            if delete:
+                obsolete = [p for p, f in card_files() if p not in wanted and p not in META_PATHS]
+                more = len(obsolete) > State.page
+                State.obsolete = obsolete[:State.page]
+        self.reply(200, "".join("+\t%s\n" % p for p in State.needed) +
+                   "".join("-\t%s\n" % p for p in State.obsolete) + ("*\tmore\n" if more else ""))
+
+    def put(self, body):
+        match = re.search(r'boundary=(\S+)', self.headers.get("Content-Type", ""))
+        if not match:
+            return self.reply(400, "Not multipart")
+        delimiter = b"--" + match.group(1).encode("utf-8")
+        if not body.startswith(delimiter) or not body.endswith(b"\r\n" + delimiter + b"--\r\n"):
+            return self.reply(400, "Body does not match Content-Length")
+        for part in body[len(delimiter):-len(b"\r\n" + delimiter + b"--\r\n")].split(b"\r\n" + delimiter):
+            head, sep, data = part.partition(b"\r\n\r\n")
+            name = re.search(rb'filename="([^"]*)"', head)
+            if not sep or not name:
+                return self.reply(400, "Malformed part")
+            path = name.group(1).decode("utf-8")
+            path = path if path.startswith("/") else "/" + path
+            if path not in State.needed:
+                return self.reply(500, path + "\n")
+            staged = local_path(STAGING_DIR + path)
+            os.makedirs(os.path.dirname(staged), exist_ok=True)
+            with open(staged, "wb") as f:
+                f.write(data)
+            State.received[path] = hashlib.md5(data).hexdigest()
+        self.reply(200, "OK")
+
+    def commit(self):
+        missing = [p for p, md5 in State.needed.items() if State.received.get(p) != md5]
+        if missing:
+            return self.reply(409, "".join(p + "\n" for p in missing))
+        for path in State.received:
+            os.makedirs(os.path.dirname(local_path(path)), exist_ok=True)
+            os.replace(local_path(STAGING_DIR + path), local_path(path))
+        for path in State.obsolete:
+            os.remove(local_path(path))
+        shutil.rmtree(local_path(STAGING_DIR), ignore_errors=True)
+        State.needed, State.obsolete, State.received = {}, [], {}
+        self.reply(200, "OK")
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Stand-in for the ClosedPlayer sync API, for testing sync.py")
+    parser.add_argument("directory", help="Local directory, taking the place of the SD card")
+    parser.add_argument("--port", type=int, default=8080)
+    parser.add_argument("--page", type=int, default=32, help="Maximum number of files per round (default: %(default)s)")
+    args = parser.parse_args()
+    State.page = args.page
+    State.root = os.path.abspath(args.directory)
+    os.makedirs(State.root, exist_ok=True)
+    server = http.server.HTTPServer(("127.0.0.1", args.port), Handler)
+    print("Serving %s on port %d" % (State.root, args.port), file=sys.stderr)
+    server.serve_forever()
+
+
+if __name__ == "__main__":
+    main()